@@ -0,0 +1,66 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QLocalSocket>
+#include <QFile>
+#include <QDebug>
+
+// Sends the jobs read from stdin to a floodfill_server listening on a local
+// socket and writes the results to stdout, once all of them are received
+
+int main(int argc, char ** argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Test client for floodfill_server");
+    parser.addHelpOption();
+    parser.addOptions({
+        {"socket", "Name of the local socket the server listens on.", "name", "floodfill_server"},
+        {"timeout", "Milliseconds to wait for each result.", "milliseconds", "60000"}
+    });
+    parser.process(app);
+
+    QFile input;
+    QFile output;
+
+    input.open(stdin, QIODevice::ReadOnly);
+    output.open(stdout, QIODevice::WriteOnly);
+
+    QLocalSocket socket;
+    socket.connectToServer(parser.value("socket"));
+    if (!socket.waitForConnected()) {
+        qCritical() << "Could not connect to" << parser.value("socket") << socket.errorString();
+        return 1;
+    }
+
+    qint32 pendingResults = 0;
+
+    while (true) {
+        const QByteArray rawLine = input.readLine();
+        if (rawLine.isEmpty()) {
+            break;
+        }
+
+        const QByteArray line = rawLine.trimmed();
+        if (line.isEmpty()) {
+            continue;
+        }
+
+        socket.write(line + '\n');
+        ++pendingResults;
+    }
+
+    while (pendingResults > 0) {
+        while (socket.canReadLine()) {
+            output.write(socket.readLine());
+            output.flush();
+            --pendingResults;
+        }
+        if (pendingResults > 0 && !socket.waitForReadyRead(parser.value("timeout").toInt())) {
+            qCritical() << "Missing" << pendingResults << "results:" << socket.errorString();
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -12,6 +12,10 @@
 #include <cmath>
 #include <array>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 struct Span
 {
     qint32 x1;
@@ -55,6 +59,23 @@ quint8 getDifference(const QImage &image, const QPoint &point, quint8 seedValue)
     return qAbs(getPixel(image, point) - seedValue);
 }
 
+template <typename T>
+void waitForTileSlot(QFutureSynchronizer<T> &futureSynchronizer,
+                     qint32 &firstRunningTile,
+                     qint32 maximumConcurrentTiles)
+{
+    // Keeps at most maximumConcurrentTiles tile tasks in the thread pool by
+    // waiting for the oldest one before adding a new one
+    if (maximumConcurrentTiles <= 0) {
+        return;
+    }
+    const QList<QFuture<T>> futures = futureSynchronizer.futures();
+    while (futures.size() - firstRunningTile >= maximumConcurrentTiles) {
+        QFuture<T> future = futures.at(firstRunningTile++);
+        future.waitForFinished();
+    }
+}
+
 QImage floodFill(const QImage &referenceImage, const QPoint &seedPoint, quint8 threshold)
 {
     Q_ASSERT(referenceImage.format() == QImage::Format_Grayscale8);
@@ -299,7 +320,8 @@ TilePropagationInfo floodFillTile(const QImage &referenceImage,
     return tilePropagationInfo;
 }
 
-QImage floodFillMT(const QImage &referenceImage, const QPoint &seedPoint, quint8 threshold)
+QImage floodFillMT(const QImage &referenceImage, const QPoint &seedPoint, quint8 threshold,
+                   QThreadPool *threadPool, qint32 maximumConcurrentTiles)
 {
     Q_ASSERT(referenceImage.format() == QImage::Format_Grayscale8);
 
@@ -333,6 +355,7 @@ QImage floodFillMT(const QImage &referenceImage, const QPoint &seedPoint, quint8
 
     while (!tilePropagationInfo.isEmpty()) {
         QFutureSynchronizer<TilePropagationInfo> futureSynchronizer;
+        qint32 firstRunningTile = 0;
 
         timer.start();
 
@@ -340,8 +363,11 @@ QImage floodFillMT(const QImage &referenceImage, const QPoint &seedPoint, quint8
         while (tilePropagationInfoIt.hasNext()) {
             tilePropagationInfoIt.next();
 
+            waitForTileSlot(futureSynchronizer, firstRunningTile, maximumConcurrentTiles);
+
             futureSynchronizer.addFuture(
                 QtConcurrent::run(
+                    threadPool,
                     [&referenceImage, &fillMaskImage, &originalSeedValue,
                      &globalRect, &tileGridSize, &threshold, tilePropagationInfoIt]
                     () -> TilePropagationInfo
@@ -532,7 +558,8 @@ TilePropagationInfoScanLine floodFillTileScanLine(const QImage &referenceImage,
     return tilePropagationInfo;
 }
 
-QImage floodFillScanLineMT(const QImage &referenceImage, const QPoint &seedPoint, quint8 threshold)
+QImage floodFillScanLineMT(const QImage &referenceImage, const QPoint &seedPoint, quint8 threshold,
+                           QThreadPool *threadPool, qint32 maximumConcurrentTiles)
 {
     Q_ASSERT(referenceImage.format() == QImage::Format_Grayscale8);
 
@@ -566,6 +593,7 @@ QImage floodFillScanLineMT(const QImage &referenceImage, const QPoint &seedPoint
 
     while (!tilePropagationInfo.isEmpty()) {
         QFutureSynchronizer<TilePropagationInfoScanLine> futureSynchronizer;
+        qint32 firstRunningTile = 0;
 
         timer.start();
 
@@ -573,8 +601,11 @@ QImage floodFillScanLineMT(const QImage &referenceImage, const QPoint &seedPoint
         while (tilePropagationInfoIt.hasNext()) {
             tilePropagationInfoIt.next();
 
+            waitForTileSlot(futureSynchronizer, firstRunningTile, maximumConcurrentTiles);
+
             futureSynchronizer.addFuture(
                 QtConcurrent::run(
+                    threadPool,
                     [&referenceImage, &fillMaskImage, &originalSeedValue,
                      &globalRect, &tileGridSize, &threshold, tilePropagationInfoIt]
                     () -> TilePropagationInfoScanLine
@@ -630,3 +661,110 @@ QImage floodFillScanLineMT(const QImage &referenceImage, const QPoint &seedPoint
 
     return fillMaskImage;
 }
+
+void selectSimilarRows(const QImage &referenceImage,
+                       QImage &fillMaskImage,
+                       qint32 firstRow,
+                       qint32 lastRow,
+                       quint8 originalSeedValue,
+                       quint8 threshold)
+{
+    const qint32 width = referenceImage.width();
+
+#ifdef __SSE2__
+    // The selection value formula needs an integer division by the
+    // threshold. Here it is replaced by the exact multiply-high sequence for
+    // 16 bit dividends (Granlund & Montgomery), so 16 pixels can be mapped
+    // at once and the results match the scalar path bit by bit
+    qint32 thresholdLog2 = 0;
+    while ((1 << thresholdLog2) < threshold) {
+        ++thresholdLog2;
+    }
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i seedValue = _mm_set1_epi8(static_cast<char>(originalSeedValue));
+    const __m128i maximumDifference = _mm_set1_epi8(static_cast<char>(threshold - 1));
+    const __m128i maximumValue = _mm_set1_epi16(255);
+    const __m128i multiplier = _mm_set1_epi16(static_cast<short>(
+        (static_cast<quint32>(65536) * ((1u << thresholdLog2) - threshold)) / threshold + 1
+    ));
+    const __m128i shift = _mm_cvtsi32_si128(thresholdLog2 > 0 ? thresholdLog2 - 1 : 0);
+#endif
+
+    for (qint32 y = firstRow; y <= lastRow; ++y) {
+        const quint8 *referencePixel = referenceImage.scanLine(y);
+        quint8 *fillMaskPixel = fillMaskImage.scanLine(y);
+        qint32 x = 0;
+
+#ifdef __SSE2__
+        for (; x + 16 <= width; x += 16, referencePixel += 16, fillMaskPixel += 16) {
+            const __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(referencePixel));
+            const __m128i difference = _mm_or_si128(_mm_subs_epu8(value, seedValue),
+                                                    _mm_subs_epu8(seedValue, value));
+            const __m128i inside = _mm_cmpeq_epi8(_mm_min_epu8(difference, maximumDifference), difference);
+            __m128i selectionValue[2];
+            for (qint32 i = 0; i < 2; ++i) {
+                const __m128i difference16 = i == 0 ? _mm_unpacklo_epi8(difference, zero)
+                                                    : _mm_unpackhi_epi8(difference, zero);
+                const __m128i dividend = _mm_mullo_epi16(difference16, maximumValue);
+                const __m128i high = _mm_mulhi_epu16(dividend, multiplier);
+                const __m128i quotient =
+                    _mm_srl_epi16(_mm_add_epi16(high, _mm_srli_epi16(_mm_sub_epi16(dividend, high), 1)), shift);
+                selectionValue[i] = _mm_sub_epi16(maximumValue, quotient);
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(fillMaskPixel),
+                             _mm_and_si128(_mm_packus_epi16(selectionValue[0], selectionValue[1]), inside));
+        }
+#endif
+
+        for (; x < width; ++x, ++referencePixel, ++fillMaskPixel) {
+            const quint8 difference = qAbs(*referencePixel - originalSeedValue);
+            *fillMaskPixel = difference >= threshold ? 0 : 255 - (difference * 255 / threshold);
+        }
+    }
+}
+
+QImage selectSimilarMT(const QImage &referenceImage, const QPoint &seedPoint, quint8 threshold,
+                       QThreadPool *threadPool, qint32 maximumConcurrentTiles)
+{
+    Q_ASSERT(referenceImage.format() == QImage::Format_Grayscale8);
+
+    QElapsedTimer timer;
+    timer.start();
+
+    QImage fillMaskImage(referenceImage.size(), referenceImage.format());
+
+    if (!referenceImage.rect().contains(seedPoint) || threshold == 0) {
+        fillMaskImage.fill(0);
+        return fillMaskImage;
+    }
+
+    const quint8 originalSeedValue = getPixel(referenceImage, seedPoint);
+    QFutureSynchronizer<void> futureSynchronizer;
+    qint32 firstRunningTile = 0;
+
+    // Every pixel is independent, so the image is just split in bands of
+    // tile rows and each band is handled by a different worker
+    for (qint32 y = 0; y < referenceImage.height(); y += tileSize.height()) {
+        const qint32 firstRow = y;
+        const qint32 lastRow = qMin(y + tileSize.height(), referenceImage.height()) - 1;
+
+        waitForTileSlot(futureSynchronizer, firstRunningTile, maximumConcurrentTiles);
+
+        futureSynchronizer.addFuture(
+            QtConcurrent::run(
+                threadPool,
+                [&referenceImage, &fillMaskImage, firstRow, lastRow, originalSeedValue, threshold]
+                ()
+                {
+                    selectSimilarRows(referenceImage, fillMaskImage, firstRow, lastRow,
+                                      originalSeedValue, threshold);
+                }
+            )
+        );
+    }
+    futureSynchronizer.waitForFinished();
+
+    qDebug() << "selectSimilarMT" << (timer.nsecsElapsed() / 1000000.0) << "ms";
+
+    return fillMaskImage;
+}
@@ -3,10 +3,22 @@
 
 #include <QImage>
 #include <QPoint>
+#include <QThreadPool>
 
 QImage floodFill(const QImage &referenceImage, const QPoint &seedPoint, quint8 threshold);
 QImage floodFillScanLine(const QImage &referenceImage, const QPoint &seedPoint, quint8 threshold);
-QImage floodFillMT(const QImage &referenceImage, const QPoint &seedPoint, quint8 threshold);
-QImage floodFillScanLineMT(const QImage &referenceImage, const QPoint &seedPoint, quint8 threshold);
+
+// The multithreaded versions run their tile tasks on threadPool, with at
+// most maximumConcurrentTiles of them queued or running at the same time
+// (0 means no limit)
+QImage floodFillMT(const QImage &referenceImage, const QPoint &seedPoint, quint8 threshold,
+                   QThreadPool *threadPool = QThreadPool::globalInstance(), qint32 maximumConcurrentTiles = 0);
+QImage floodFillScanLineMT(const QImage &referenceImage, const QPoint &seedPoint, quint8 threshold,
+                           QThreadPool *threadPool = QThreadPool::globalInstance(), qint32 maximumConcurrentTiles = 0);
+
+// Non contiguous version: selects every pixel of the image that is similar
+// to the seed point, connected to it or not
+QImage selectSimilarMT(const QImage &referenceImage, const QPoint &seedPoint, quint8 threshold,
+                       QThreadPool *threadPool = QThreadPool::globalInstance(), qint32 maximumConcurrentTiles = 0);
 
 #endif
@@ -0,0 +1,410 @@
+#include "postprocess.h"
+
+#include "floodfill.h"
+
+#include <QtConcurrent>
+#include <QFuture>
+#include <QFutureSynchronizer>
+#include <QElapsedTimer>
+
+#include <cmath>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+struct PostProcessKernel
+{
+    PostProcessOperation::Type type;
+    qint32 radius;
+    QVector<quint16> weights;
+};
+
+static constexpr QSize tileSizePostProcess {64, 64};
+// The kernels fused in a segment share the halo of its tiles, which grows
+// with the sum of their radii. Past this halo the tiles would mostly process
+// their neighbors' pixels, so the segment is closed and a new one started
+static constexpr qint32 maximumFusedHalo {tileSizePostProcess.width() / 2};
+
+QVector<quint16> gaussianWeights(qint32 radius)
+{
+    // Weights are in 16 bit fixed point. They are computed from the rounded
+    // cumulative sum so that they always add up to exactly 65536
+    const qreal sigma = radius / 2.0;
+    QVector<qreal> cumulativeWeights(2 * radius + 2, 0.0);
+
+    for (qint32 i = 0; i <= 2 * radius; ++i) {
+        const qreal x = i - radius;
+        cumulativeWeights[i + 1] = cumulativeWeights[i] + std::exp(-(x * x) / (2.0 * sigma * sigma));
+    }
+
+    QVector<quint16> weights(2 * radius + 1);
+    const qreal scale = 65536.0 / cumulativeWeights.last();
+
+    for (qint32 i = 0; i <= 2 * radius; ++i) {
+        const qint32 weight = qRound(cumulativeWeights[i + 1] * scale) - qRound(cumulativeWeights[i] * scale);
+        Q_ASSERT(weight >= 0 && weight < 65536);
+        weights[i] = weight;
+    }
+
+    return weights;
+}
+
+struct MaximumFilter
+{
+    static quint8 apply(quint8 first, quint8 second) { return qMax(first, second); }
+#ifdef __SSE2__
+    static __m128i apply(__m128i first, __m128i second) { return _mm_max_epu8(first, second); }
+#endif
+};
+
+struct MinimumFilter
+{
+    static quint8 apply(quint8 first, quint8 second) { return qMin(first, second); }
+#ifdef __SSE2__
+    static __m128i apply(__m128i first, __m128i second) { return _mm_min_epu8(first, second); }
+#endif
+};
+
+template <typename Filter>
+void combineLines(const quint8 *first, const quint8 *second, quint8 *destination, qint32 count)
+{
+    qint32 i = 0;
+
+#ifdef __SSE2__
+    for (; i + 16 <= count; i += 16) {
+        const __m128i value = Filter::apply(_mm_loadu_si128(reinterpret_cast<const __m128i*>(first + i)),
+                                            _mm_loadu_si128(reinterpret_cast<const __m128i*>(second + i)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), value);
+    }
+#endif
+
+    for (; i < count; ++i) {
+        destination[i] = Filter::apply(first[i], second[i]);
+    }
+}
+
+// Grow and shrink use the van Herk/Gil-Werman running maximum and minimum.
+// The values are split in blocks of taps values, keeping the result from the
+// start of each block to every value in prefix and from every value to the
+// end of its block in suffix. Any window of taps values spans at most two
+// blocks, so its result takes one suffix and one prefix value, whatever the
+// radius
+template <typename Filter>
+void extremumRowKernel(const quint8 *source, qint32 taps, quint8 *prefix, quint8 *suffix,
+                       quint8 *destination, qint32 length)
+{
+    for (qint32 blockStart = 0; blockStart < length; blockStart += taps) {
+        const qint32 blockEnd = qMin(blockStart + taps, length);
+        prefix[blockStart] = source[blockStart];
+        for (qint32 i = blockStart + 1; i < blockEnd; ++i) {
+            prefix[i] = Filter::apply(prefix[i - 1], source[i]);
+        }
+        suffix[blockEnd - 1] = source[blockEnd - 1];
+        for (qint32 i = blockEnd - 2; i >= blockStart; --i) {
+            suffix[i] = Filter::apply(suffix[i + 1], source[i]);
+        }
+    }
+
+    for (qint32 i = 0; i + taps <= length; ++i) {
+        destination[i] = Filter::apply(suffix[i], prefix[i + taps - 1]);
+    }
+}
+
+// Same as extremumRowKernel down the columns, a whole row at a time
+template <typename Filter>
+void extremumColumnsKernel(const quint8 *source, qint32 stride, qint32 taps, quint8 *prefix, quint8 *suffix,
+                           quint8 *destination, qint32 width, qint32 height)
+{
+    for (qint32 blockStart = 0; blockStart < height; blockStart += taps) {
+        const qint32 blockEnd = qMin(blockStart + taps, height);
+        std::memcpy(prefix + blockStart * stride, source + blockStart * stride, width);
+        for (qint32 y = blockStart + 1; y < blockEnd; ++y) {
+            combineLines<Filter>(prefix + (y - 1) * stride, source + y * stride, prefix + y * stride, width);
+        }
+        std::memcpy(suffix + (blockEnd - 1) * stride, source + (blockEnd - 1) * stride, width);
+        for (qint32 y = blockEnd - 2; y >= blockStart; --y) {
+            combineLines<Filter>(suffix + (y + 1) * stride, source + y * stride, suffix + y * stride, width);
+        }
+    }
+
+    for (qint32 y = 0; y + taps <= height; ++y) {
+        combineLines<Filter>(suffix + y * stride, prefix + (y + taps - 1) * stride, destination + y * stride, width);
+    }
+}
+
+void featherKernel(const quint8 *source, qint32 tapStride, const QVector<quint16> &weights,
+                   quint8 *destination, qint32 count)
+{
+    const qint32 taps = weights.size();
+    qint32 i = 0;
+
+#ifdef __SSE2__
+    // The products of the 8 bit values and the 16 bit weights need 24 bits,
+    // so the low and high halves are recombined into 32 bit accumulators
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rounding = _mm_set1_epi32(32768);
+    for (; i + 8 <= count; i += 8) {
+        __m128i accumulatorLow = rounding;
+        __m128i accumulatorHigh = rounding;
+        for (qint32 k = 0; k < taps; ++k) {
+            const __m128i value = _mm_unpacklo_epi8(
+                _mm_loadl_epi64(reinterpret_cast<const __m128i*>(source + i + k * tapStride)), zero
+            );
+            const __m128i weight = _mm_set1_epi16(static_cast<short>(weights[k]));
+            const __m128i productLow = _mm_mullo_epi16(value, weight);
+            const __m128i productHigh = _mm_mulhi_epu16(value, weight);
+            accumulatorLow = _mm_add_epi32(accumulatorLow, _mm_unpacklo_epi16(productLow, productHigh));
+            accumulatorHigh = _mm_add_epi32(accumulatorHigh, _mm_unpackhi_epi16(productLow, productHigh));
+        }
+        const __m128i result = _mm_packs_epi32(_mm_srli_epi32(accumulatorLow, 16),
+                                               _mm_srli_epi32(accumulatorHigh, 16));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(destination + i), _mm_packus_epi16(result, result));
+    }
+#endif
+
+    for (; i < count; ++i) {
+        quint32 accumulator = 32768;
+        for (qint32 k = 0; k < taps; ++k) {
+            accumulator += source[i + k * tapStride] * static_cast<quint32>(weights[k]);
+        }
+        destination[i] = accumulator >> 16;
+    }
+}
+
+void applyRowKernel(const PostProcessKernel &kernel, const quint8 *source, quint8 *prefix, quint8 *suffix,
+                    quint8 *destination, qint32 length)
+{
+    switch (kernel.type) {
+    case PostProcessOperation::Grow:
+        extremumRowKernel<MaximumFilter>(source, 2 * kernel.radius + 1, prefix, suffix, destination, length);
+        break;
+    case PostProcessOperation::Shrink:
+        extremumRowKernel<MinimumFilter>(source, 2 * kernel.radius + 1, prefix, suffix, destination, length);
+        break;
+    case PostProcessOperation::Feather:
+        featherKernel(source, 1, kernel.weights, destination, length - 2 * kernel.radius);
+        break;
+    default:
+        Q_UNREACHABLE();
+    }
+}
+
+void applyColumnsKernel(const PostProcessKernel &kernel, const quint8 *source, qint32 stride,
+                        quint8 *prefix, quint8 *suffix, quint8 *destination, qint32 width, qint32 height)
+{
+    switch (kernel.type) {
+    case PostProcessOperation::Grow:
+        extremumColumnsKernel<MaximumFilter>(source, stride, 2 * kernel.radius + 1, prefix, suffix,
+                                             destination, width, height);
+        break;
+    case PostProcessOperation::Shrink:
+        extremumColumnsKernel<MinimumFilter>(source, stride, 2 * kernel.radius + 1, prefix, suffix,
+                                             destination, width, height);
+        break;
+    case PostProcessOperation::Feather:
+        for (qint32 y = 0; y < height - 2 * kernel.radius; ++y) {
+            featherKernel(source + y * stride, stride, kernel.weights, destination + y * stride, width);
+        }
+        break;
+    default:
+        Q_UNREACHABLE();
+    }
+}
+
+void postProcessTile(const QImage &fillMaskImage,
+                     const QImage &backgroundImage,
+                     QImage &resultImage,
+                     const QVector<PostProcessKernel> &kernels,
+                     qint32 halo,
+                     const QRect &globalRect,
+                     const QRect &tileRect)
+{
+    // The tile is loaded with a halo wide enough for all the kernels. Pixels
+    // outside the image replicate the nearest border pixel, so the result does
+    // not depend on the tiling. Every separable pass consumes its radius from
+    // each side of the valid region until only the tile itself remains
+    const qint32 stride = tileRect.width() + 2 * halo;
+    qint32 width = stride;
+    qint32 height = tileRect.height() + 2 * halo;
+    QVector<quint8> buffers[2] {QVector<quint8>(stride * height), QVector<quint8>(stride * height)};
+    quint8 *source = buffers[0].data();
+    quint8 *destination = buffers[1].data();
+
+    // Grow and shrink need two more buffers for their running results
+    QVector<quint8> prefixBuffer;
+    QVector<quint8> suffixBuffer;
+    for (const PostProcessKernel &kernel : kernels) {
+        if (kernel.type != PostProcessOperation::Feather) {
+            prefixBuffer.resize(stride * height);
+            suffixBuffer.resize(stride * height);
+            break;
+        }
+    }
+    quint8 *prefix = prefixBuffer.data();
+    quint8 *suffix = suffixBuffer.data();
+
+    for (qint32 y = 0; y < height; ++y) {
+        const qint32 globalY = qBound(globalRect.top(), tileRect.top() - halo + y, globalRect.bottom());
+        const quint8 *fillMaskPixel = fillMaskImage.scanLine(globalY);
+        quint8 *tilePixel = source + y * stride;
+        for (qint32 x = 0; x < width; ++x, ++tilePixel) {
+            const qint32 globalX = qBound(globalRect.left(), tileRect.left() - halo + x, globalRect.right());
+            *tilePixel = fillMaskPixel[globalX];
+        }
+        // The background image is padded by one pixel on each side
+        if (!backgroundImage.isNull()) {
+            const quint8 *backgroundPixel = backgroundImage.scanLine(globalY + 1) + 1;
+            tilePixel = source + y * stride;
+            for (qint32 x = 0; x < width; ++x, ++tilePixel) {
+                const qint32 globalX = qBound(globalRect.left(), tileRect.left() - halo + x, globalRect.right());
+                if (*tilePixel == 0 && backgroundPixel[globalX] == 0) {
+                    *tilePixel = 255;
+                }
+            }
+        }
+    }
+
+    for (const PostProcessKernel &kernel : kernels) {
+        for (qint32 y = 0; y < height; ++y) {
+            applyRowKernel(kernel, source + y * stride, prefix + y * stride, suffix + y * stride,
+                           destination + y * stride, width);
+        }
+        width -= 2 * kernel.radius;
+        qSwap(source, destination);
+
+        applyColumnsKernel(kernel, source, stride, prefix, suffix, destination, width, height);
+        height -= 2 * kernel.radius;
+        qSwap(source, destination);
+    }
+
+    Q_ASSERT(width == tileRect.width() && height == tileRect.height());
+
+    for (qint32 y = 0; y < height; ++y) {
+        std::memcpy(resultImage.scanLine(tileRect.top() + y) + tileRect.left(), source + y * stride, width);
+    }
+}
+
+QImage postProcessSegmentMT(const QImage &fillMaskImage,
+                            const QImage &backgroundImage,
+                            const QVector<PostProcessKernel> &kernels)
+{
+    QImage resultImage(fillMaskImage.size(), fillMaskImage.format());
+
+    qint32 halo = 0;
+    for (const PostProcessKernel &kernel : kernels) {
+        halo += kernel.radius;
+    }
+
+    const QRect globalRect = fillMaskImage.rect();
+    const QSize tileGridSize(
+        std::ceil(static_cast<qreal>(globalRect.width()) / tileSizePostProcess.width()),
+        std::ceil(static_cast<qreal>(globalRect.height()) / tileSizePostProcess.height())
+    );
+    QFutureSynchronizer<void> futureSynchronizer;
+
+    for (qint32 y = 0; y < tileGridSize.height(); ++y) {
+        for (qint32 x = 0; x < tileGridSize.width(); ++x) {
+            const QRect tileRect = QRect(
+                x * tileSizePostProcess.width(),
+                y * tileSizePostProcess.height(),
+                tileSizePostProcess.width(), tileSizePostProcess.height()
+            ).intersected(globalRect);
+
+            futureSynchronizer.addFuture(
+                QtConcurrent::run(
+                    [&fillMaskImage, &backgroundImage, &resultImage, &kernels, halo, &globalRect, tileRect]
+                    ()
+                    {
+                        postProcessTile(fillMaskImage, backgroundImage, resultImage, kernels,
+                                        halo, globalRect, tileRect);
+                    }
+                )
+            );
+        }
+    }
+    futureSynchronizer.waitForFinished();
+
+    return resultImage;
+}
+
+QImage fillMaskBackground(const QImage &fillMaskImage)
+{
+    // The background is the unselected region connected to the image border.
+    // The mask is binarized into an image with a one pixel unselected frame
+    // and filled from a corner, reusing the multithreaded scanline floodfill.
+    // The padded size is rounded up to whole tiles
+    const QSize paddedSize(
+        std::ceil(static_cast<qreal>(fillMaskImage.width() + 2) / tileSizePostProcess.width()) * tileSizePostProcess.width(),
+        std::ceil(static_cast<qreal>(fillMaskImage.height() + 2) / tileSizePostProcess.height()) * tileSizePostProcess.height()
+    );
+    QImage referenceImage(paddedSize, QImage::Format_Grayscale8);
+    referenceImage.fill(0);
+
+    for (qint32 y = 0; y < fillMaskImage.height(); ++y) {
+        const quint8 *fillMaskPixel = fillMaskImage.scanLine(y);
+        quint8 *referencePixel = referenceImage.scanLine(y + 1) + 1;
+        for (qint32 x = 0; x < fillMaskImage.width(); ++x, ++fillMaskPixel, ++referencePixel) {
+            *referencePixel = *fillMaskPixel > 0 ? 255 : 0;
+        }
+    }
+
+    return floodFillScanLineMT(referenceImage, QPoint(0, 0), 1);
+}
+
+QImage postProcessMT(const QImage &fillMaskImage, const PostProcessPipeline &pipeline)
+{
+    Q_ASSERT(fillMaskImage.format() == QImage::Format_Grayscale8);
+
+    QElapsedTimer timer;
+    timer.start();
+
+    QImage resultImage = fillMaskImage;
+    QImage backgroundImage;
+    QVector<PostProcessKernel> kernels;
+    qint32 halo = 0;
+
+    for (const PostProcessOperation &operation : pipeline) {
+        if (operation.type == PostProcessOperation::FillHoles) {
+            if (!kernels.isEmpty()) {
+                resultImage = postProcessSegmentMT(resultImage, backgroundImage, kernels);
+                backgroundImage = QImage();
+                kernels.clear();
+                halo = 0;
+            }
+            // Filling holes twice in a row does nothing more
+            if (backgroundImage.isNull()) {
+                backgroundImage = fillMaskBackground(resultImage);
+            }
+            continue;
+        }
+
+        if (operation.radius <= 0) {
+            continue;
+        }
+
+        if (!kernels.isEmpty() && halo + operation.radius > maximumFusedHalo) {
+            resultImage = postProcessSegmentMT(resultImage, backgroundImage, kernels);
+            backgroundImage = QImage();
+            kernels.clear();
+            halo = 0;
+        }
+
+        halo += operation.radius;
+        kernels.append({
+            operation.type,
+            operation.radius,
+            operation.type == PostProcessOperation::Feather ? gaussianWeights(operation.radius)
+                                                            : QVector<quint16>()
+        });
+    }
+
+    if (!kernels.isEmpty() || !backgroundImage.isNull()) {
+        resultImage = postProcessSegmentMT(resultImage, backgroundImage, kernels);
+    }
+
+    qDebug() << "postProcessMT" << (timer.nsecsElapsed() / 1000000.0) << "ms";
+
+    return resultImage;
+}
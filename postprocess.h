@@ -0,0 +1,30 @@
+#ifndef POSTPROCESS_H
+#define POSTPROCESS_H
+
+#include <QImage>
+#include <QVector>
+
+struct PostProcessOperation
+{
+    enum Type
+    {
+        Grow,
+        Shrink,
+        Feather,
+        FillHoles
+    };
+
+    Type type;
+    qint32 radius;
+};
+
+using PostProcessPipeline = QVector<PostProcessOperation>;
+
+// Applies the operations of the pipeline, in order, to a fill mask image.
+// Consecutive grow, shrink and feather operations are fused and computed
+// tile by tile, so no intermediate full size images are created for them.
+// Only fill holes needs a full size pass, to find the background connected
+// to the image border
+QImage postProcessMT(const QImage &fillMaskImage, const PostProcessPipeline &pipeline);
+
+#endif
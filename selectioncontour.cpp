@@ -0,0 +1,354 @@
+#include "selectioncontour.h"
+
+#include <QHash>
+#include <QSet>
+#include <QStack>
+#include <QPair>
+#include <QtConcurrent>
+#include <QFuture>
+#include <QFutureSynchronizer>
+#include <QElapsedTimer>
+
+#include <cmath>
+
+// Contour points are kept in doubled integer coordinates, where the pixel
+// (x, y) is at (2x, 2y). This way the middle points of the cell edges are
+// integers and the fragments of neighbor tiles can be matched exactly
+using ContourPoint = QPoint;
+using ContourPolyline = QVector<ContourPoint>;
+
+struct TileContours
+{
+    QVector<ContourPolyline> closedContours;
+    QVector<ContourPolyline> openFragments;
+};
+
+static constexpr QSize tileSizeContour {64, 64};
+
+enum CellEdge
+{
+    Top,
+    Right,
+    Bottom,
+    Left,
+    None
+};
+
+// Directed segments for each marching squares case, indexed by
+// topLeft << 3 | topRight << 2 | bottomRight << 1 | bottomLeft, as pairs of
+// (from, to) edges. They are oriented so that the inside is on the right
+static constexpr CellEdge cellSegments[16][4] = {
+    {None, None, None, None},
+    {Left, Bottom, None, None},
+    {Bottom, Right, None, None},
+    {Left, Right, None, None},
+    {Right, Top, None, None},
+    {Left, Bottom, Right, Top},
+    {Bottom, Top, None, None},
+    {Left, Top, None, None},
+    {Top, Left, None, None},
+    {Top, Bottom, None, None},
+    {Top, Left, Bottom, Right},
+    {Top, Right, None, None},
+    {Right, Left, None, None},
+    {Right, Bottom, None, None},
+    {Bottom, Left, None, None},
+    {None, None, None, None}
+};
+
+inline quint64 contourPointKey(const ContourPoint &point)
+{
+    return (static_cast<quint64>(static_cast<quint32>(point.x())) << 32) | static_cast<quint32>(point.y());
+}
+
+ContourPoint cellEdgePoint(qint32 cellX, qint32 cellY, CellEdge edge)
+{
+    // The cell (cellX, cellY) has the pixel (cellX - 1, cellY - 1) as its
+    // top left corner and the pixel (cellX, cellY) as its bottom right corner
+    switch (edge) {
+    case Top:
+        return {2 * cellX - 1, 2 * cellY - 2};
+    case Right:
+        return {2 * cellX, 2 * cellY - 1};
+    case Bottom:
+        return {2 * cellX - 1, 2 * cellY};
+    case Left:
+        return {2 * cellX - 2, 2 * cellY - 1};
+    default:
+        Q_UNREACHABLE();
+    }
+}
+
+TileContours extractTileContours(const QImage &fillMaskImage,
+                                 quint8 level,
+                                 const QRect &globalRect,
+                                 const QRect &cellRect)
+{
+    TileContours tileContours;
+    QVector<QPair<ContourPoint, ContourPoint>> segments;
+    QHash<quint64, qint32> segmentsByStart;
+    QSet<quint64> segmentEnds;
+
+    const auto isInside =
+        [&fillMaskImage, &globalRect, level](qint32 x, qint32 y) -> quint32
+        {
+            if (x < globalRect.left() || x > globalRect.right() ||
+                y < globalRect.top() || y > globalRect.bottom()) {
+                return 0;
+            }
+            return *(fillMaskImage.scanLine(y) + x) >= level ? 1 : 0;
+        };
+
+    for (qint32 cellY = cellRect.top(); cellY <= cellRect.bottom(); ++cellY) {
+        quint32 topLeft = isInside(cellRect.left() - 1, cellY - 1);
+        quint32 bottomLeft = isInside(cellRect.left() - 1, cellY);
+        for (qint32 cellX = cellRect.left(); cellX <= cellRect.right(); ++cellX) {
+            const quint32 topRight = isInside(cellX, cellY - 1);
+            const quint32 bottomRight = isInside(cellX, cellY);
+            const CellEdge *cellSegment = cellSegments[topLeft << 3 | topRight << 2 | bottomRight << 1 | bottomLeft];
+
+            for (qint32 i = 0; i < 4 && cellSegment[i] != None; i += 2) {
+                const ContourPoint start = cellEdgePoint(cellX, cellY, cellSegment[i]);
+                const ContourPoint end = cellEdgePoint(cellX, cellY, cellSegment[i + 1]);
+                segmentsByStart.insert(contourPointKey(start), segments.size());
+                segmentEnds.insert(contourPointKey(end));
+                segments.append({start, end});
+            }
+
+            topLeft = topRight;
+            bottomLeft = bottomRight;
+        }
+    }
+
+    // Every contour point has exactly one segment leaving it and one arriving
+    // to it. Chains whose start has no arriving segment in this tile continue
+    // in another tile, the rest are closed inside the tile
+    QVector<bool> visited(segments.size(), false);
+
+    const auto followChain =
+        [&segments, &segmentsByStart, &visited](qint32 segment) -> ContourPolyline
+        {
+            ContourPolyline polyline {segments.at(segment).first};
+            while (segment != -1 && !visited.at(segment)) {
+                visited[segment] = true;
+                polyline.append(segments.at(segment).second);
+                segment = segmentsByStart.value(contourPointKey(segments.at(segment).second), -1);
+            }
+            return polyline;
+        };
+
+    for (qint32 i = 0; i < segments.size(); ++i) {
+        if (!segmentEnds.contains(contourPointKey(segments.at(i).first))) {
+            tileContours.openFragments.append(followChain(i));
+        }
+    }
+    for (qint32 i = 0; i < segments.size(); ++i) {
+        if (!visited.at(i)) {
+            ContourPolyline polyline = followChain(i);
+            polyline.removeLast();
+            tileContours.closedContours.append(polyline);
+        }
+    }
+
+    return tileContours;
+}
+
+QPolygonF contourPolylineToPolygon(const ContourPolyline &polyline)
+{
+    // Pixel centers are at (x + 0.5, y + 0.5)
+    QPolygonF polygon;
+    polygon.reserve(polyline.size());
+    for (const ContourPoint &point : polyline) {
+        polygon.append(QPointF(point.x() / 2.0 + 0.5, point.y() / 2.0 + 0.5));
+    }
+    return polygon;
+}
+
+qreal distanceToSegment(const QPointF &point, const QPointF &segmentStart, const QPointF &segmentEnd)
+{
+    const QPointF segment = segmentEnd - segmentStart;
+    const qreal segmentLengthSquared = QPointF::dotProduct(segment, segment);
+    QPointF projection = segmentStart;
+
+    if (segmentLengthSquared > 0.0) {
+        const qreal t = qBound(0.0, QPointF::dotProduct(point - segmentStart, segment) / segmentLengthSquared, 1.0);
+        projection += t * segment;
+    }
+
+    const QPointF difference = point - projection;
+    return std::sqrt(QPointF::dotProduct(difference, difference));
+}
+
+QPolygonF simplifyContour(const QPolygonF &contour, qreal tolerance)
+{
+    if (contour.size() < 4) {
+        return contour;
+    }
+
+    // Ramer-Douglas-Peucker. The closed contour is split in two open
+    // polylines at its first point and the point farthest from it
+    const qint32 size = contour.size();
+    const auto pointAt = [&contour, size](qint32 i) -> const QPointF & { return contour.at(i % size); };
+
+    qint32 farthest = 0;
+    qreal farthestDistance = -1.0;
+    for (qint32 i = 1; i < size; ++i) {
+        const qreal distance = distanceToSegment(contour.at(i), contour.first(), contour.first());
+        if (distance > farthestDistance) {
+            farthest = i;
+            farthestDistance = distance;
+        }
+    }
+
+    // The farthest point of each half is always kept, so the contour never
+    // collapses into a segment, even when all of it is within the tolerance
+    struct Range
+    {
+        qint32 first;
+        qint32 last;
+        bool keepFarthest;
+    };
+
+    QVector<bool> keep(size, false);
+    QStack<Range> ranges;
+
+    keep[0] = true;
+    keep[farthest] = true;
+    ranges.push({0, farthest, true});
+    ranges.push({farthest, size, true});
+
+    while (!ranges.isEmpty()) {
+        const Range range = ranges.pop();
+
+        qint32 farthestInRange = -1;
+        qreal farthestDistanceInRange = range.keepFarthest ? -1.0 : tolerance;
+        for (qint32 i = range.first + 1; i < range.last; ++i) {
+            const qreal distance = distanceToSegment(contour.at(i), pointAt(range.first), pointAt(range.last));
+            if (distance > farthestDistanceInRange) {
+                farthestInRange = i;
+                farthestDistanceInRange = distance;
+            }
+        }
+
+        if (farthestInRange != -1) {
+            keep[farthestInRange] = true;
+            ranges.push({range.first, farthestInRange, false});
+            ranges.push({farthestInRange, range.last, false});
+        }
+    }
+
+    QPolygonF simplifiedContour;
+    for (qint32 i = 0; i < size; ++i) {
+        if (keep.at(i)) {
+            simplifiedContour.append(contour.at(i));
+        }
+    }
+
+    return simplifiedContour;
+}
+
+QVector<QPolygonF> extractSelectionContoursMT(const QImage &fillMaskImage, quint8 level, qreal simplifyTolerance)
+{
+    Q_ASSERT(fillMaskImage.format() == QImage::Format_Grayscale8);
+
+    QElapsedTimer globalTimer;
+    QElapsedTimer timer;
+    globalTimer.start();
+
+    QVector<QPolygonF> contours;
+
+    // There is one cell more than pixels in each direction, so that the
+    // selection is surrounded by unselected pixels and all contours are closed
+    const QRect globalRect = fillMaskImage.rect();
+    const QRect cellGridRect(0, 0, globalRect.width() + 1, globalRect.height() + 1);
+    const QSize tileGridSize(
+        std::ceil(static_cast<qreal>(cellGridRect.width()) / tileSizeContour.width()),
+        std::ceil(static_cast<qreal>(cellGridRect.height()) / tileSizeContour.height())
+    );
+
+    timer.start();
+
+    QFutureSynchronizer<TileContours> futureSynchronizer;
+
+    for (qint32 y = 0; y < tileGridSize.height(); ++y) {
+        for (qint32 x = 0; x < tileGridSize.width(); ++x) {
+            const QRect cellRect = QRect(
+                x * tileSizeContour.width(),
+                y * tileSizeContour.height(),
+                tileSizeContour.width(), tileSizeContour.height()
+            ).intersected(cellGridRect);
+
+            futureSynchronizer.addFuture(
+                QtConcurrent::run(
+                    [&fillMaskImage, level, &globalRect, cellRect]
+                    () -> TileContours
+                    {
+                        return extractTileContours(fillMaskImage, level, globalRect, cellRect);
+                    }
+                )
+            );
+        }
+    }
+    futureSynchronizer.waitForFinished();
+
+    const qint64 processingTime = timer.nsecsElapsed();
+    timer.start();
+
+    // Fragments that leave a tile are joined with the ones that enter the
+    // neighbor tile at the same point, until the contour is closed
+    QVector<ContourPolyline> openFragments;
+
+    for (QFuture<TileContours> future : futureSynchronizer.futures()) {
+        const TileContours tileContours = future.result();
+        for (const ContourPolyline &closedContour : tileContours.closedContours) {
+            contours.append(contourPolylineToPolygon(closedContour));
+        }
+        openFragments.append(tileContours.openFragments);
+    }
+
+    QHash<quint64, qint32> openFragmentsByStart;
+    openFragmentsByStart.reserve(openFragments.size());
+    for (qint32 i = 0; i < openFragments.size(); ++i) {
+        openFragmentsByStart.insert(contourPointKey(openFragments.at(i).first()), i);
+    }
+
+    QVector<bool> stitched(openFragments.size(), false);
+
+    for (qint32 i = 0; i < openFragments.size(); ++i) {
+        if (stitched.at(i)) {
+            continue;
+        }
+
+        ContourPolyline polyline = openFragments.at(i);
+        stitched[i] = true;
+
+        while (true) {
+            const qint32 next = openFragmentsByStart.value(contourPointKey(polyline.last()), -1);
+            Q_ASSERT(next != -1);
+            if (next == i || next == -1) {
+                break;
+            }
+            stitched[next] = true;
+            polyline.append(openFragments.at(next).mid(1));
+        }
+
+        polyline.removeLast();
+        contours.append(contourPolylineToPolygon(polyline));
+    }
+
+    const qint64 stitchingTime = timer.nsecsElapsed();
+
+    if (simplifyTolerance > 0.0) {
+        QtConcurrent::blockingMap(contours,
+                                  [simplifyTolerance](QPolygonF &contour)
+                                  {
+                                      contour = simplifyContour(contour, simplifyTolerance);
+                                  });
+    }
+
+    qDebug() << "processingTime" << (processingTime / 1000000.0) << "ms";
+    qDebug() << "stitching time" << (stitchingTime / 1000000.0) << "ms";
+    qDebug() << "extractSelectionContoursMT" << (globalTimer.nsecsElapsed() / 1000000.0) << "ms";
+
+    return contours;
+}
@@ -0,0 +1,19 @@
+#ifndef SELECTIONCONTOUR_H
+#define SELECTIONCONTOUR_H
+
+#include <QImage>
+#include <QPolygonF>
+#include <QVector>
+
+// Extracts the boundary of the selection (the pixels of the fill mask image
+// with a value greater or equal than level) as closed polygons, using
+// marching squares. Pixels only connected by a corner are kept separated,
+// like in the floodfill. Walking along a contour in image coordinates, the
+// selection is always on the right. If simplifyTolerance is greater than 0,
+// the polygons are simplified keeping them within that distance of the
+// original contour
+QVector<QPolygonF> extractSelectionContoursMT(const QImage &fillMaskImage,
+                                              quint8 level = 1,
+                                              qreal simplifyTolerance = 0.0);
+
+#endif
@@ -0,0 +1,384 @@
+#include "server.h"
+
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QMutexLocker>
+#include <QtConcurrent>
+#include <QDebug>
+
+#include "floodfill.h"
+
+// All the work of a fill runs on the compute pool passed to it. The
+// multithreaded fills get at most maximumConcurrentTiles tile tasks in it and
+// the single threaded ones run as one task of that pool
+using FillFunction = std::function<QImage(const QImage &, const QPoint &, quint8, QThreadPool *, qint32)>;
+
+static const QHash<QString, FillFunction> fillFunctions {
+    {"floodFill",
+     [](const QImage &referenceImage, const QPoint &seedPoint, quint8 threshold, QThreadPool *threadPool, qint32)
+     {
+         return QtConcurrent::run(threadPool, floodFill, referenceImage, seedPoint, threshold).result();
+     }},
+    {"floodFillScanLine",
+     [](const QImage &referenceImage, const QPoint &seedPoint, quint8 threshold, QThreadPool *threadPool, qint32)
+     {
+         return QtConcurrent::run(threadPool, floodFillScanLine, referenceImage, seedPoint, threshold).result();
+     }},
+    {"floodFillMT", floodFillMT},
+    {"floodFillScanLineMT", floodFillScanLineMT},
+    {"selectSimilarMT", selectSimilarMT}
+};
+
+bool parseFillJob(const QByteArray &line, FillJob &job, QString &error)
+{
+    QJsonParseError parseError;
+    const QJsonDocument document = QJsonDocument::fromJson(line, &parseError);
+
+    if (!document.isObject()) {
+        error = parseError.error != QJsonParseError::NoError ? parseError.errorString()
+                                                             : QStringLiteral("job is not an object");
+        return false;
+    }
+
+    const QJsonObject object = document.object();
+
+    job.id = object.value("id").toVariant().toString();
+    job.imagePath = object.value("image").toString();
+    job.algorithm = object.value("algorithm").toString("floodFillScanLineMT");
+    job.outputPath = object.value("output").toString();
+    job.outputFormat = object.value("format").toString().toLatin1();
+
+    if (job.imagePath.isEmpty()) {
+        error = QStringLiteral("missing image");
+        return false;
+    }
+    if (!fillFunctions.contains(job.algorithm)) {
+        error = QStringLiteral("unknown algorithm ") + job.algorithm;
+        return false;
+    }
+
+    const qint32 defaultThreshold = object.value("threshold").toInt(128);
+
+    for (const QJsonValue &seedValue : object.value("seeds").toArray()) {
+        const QJsonObject seedObject = seedValue.toObject();
+        const qint32 threshold = seedObject.value("threshold").toInt(defaultThreshold);
+
+        if (!seedObject.contains("x") || !seedObject.contains("y")) {
+            error = QStringLiteral("seeds need x and y");
+            return false;
+        }
+        if (threshold < 0 || threshold > 255) {
+            error = QStringLiteral("threshold out of range");
+            return false;
+        }
+
+        job.seeds.append({
+            QPoint(seedObject.value("x").toInt(), seedObject.value("y").toInt()),
+            static_cast<quint8>(threshold)
+        });
+    }
+
+    if (job.seeds.isEmpty()) {
+        error = QStringLiteral("missing seeds");
+        return false;
+    }
+
+    return true;
+}
+
+QByteArray fillJobResultToJson(const FillJob &job, const FillJobResult &result)
+{
+    QJsonObject object {
+        {"id", job.id},
+        {"status", result.ok ? "ok" : "error"},
+        {"cacheHit", result.cacheHit},
+        {"queueMs", result.queueTime / 1000000.0},
+        {"fillMs", result.processingTime / 1000000.0},
+        {"latencyMs", result.latency / 1000000.0},
+        {"queueDepth", result.queueDepth}
+    };
+
+    if (!result.ok) {
+        object.insert("error", result.error);
+    }
+
+    return QJsonDocument(object).toJson(QJsonDocument::Compact) + '\n';
+}
+
+imageCache::imageCache(qint32 maximumSizeInMegabytes)
+{
+    // Costs are in kilobytes
+    m_cache.setMaxCost(maximumSizeInMegabytes * 1024);
+}
+
+QImage imageCache::image(const QString &path, bool *cacheHit)
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (const QImage *cachedImage = m_cache.object(path)) {
+        *cacheHit = true;
+        return *cachedImage;
+    }
+
+    if (const QSharedPointer<PendingDecode> pendingDecode = m_pendingDecodes.value(path)) {
+        while (!pendingDecode->done) {
+            m_decodeCondition.wait(&m_mutex);
+        }
+        *cacheHit = true;
+        return pendingDecode->image;
+    }
+
+    const QSharedPointer<PendingDecode> pendingDecode(new PendingDecode);
+    m_pendingDecodes.insert(path, pendingDecode);
+    *cacheHit = false;
+
+    // Decode without holding the lock, so other jobs can use the cache
+    locker.unlock();
+    const QImage image = QImage(path).convertToFormat(QImage::Format_Grayscale8);
+    locker.relock();
+
+    if (!image.isNull()) {
+        m_cache.insert(path, new QImage(image), qMax<qint64>(1, image.sizeInBytes() / 1024));
+        m_imageSizes.insert(path, image.size());
+    }
+
+    pendingDecode->image = image;
+    pendingDecode->done = true;
+    m_pendingDecodes.remove(path);
+    m_decodeCondition.wakeAll();
+
+    return image;
+}
+
+QSize imageCache::imageSize(const QString &path)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        if (const QImage *cachedImage = m_cache.object(path)) {
+            return cachedImage->size();
+        }
+        if (m_imageSizes.contains(path)) {
+            return m_imageSizes.value(path);
+        }
+    }
+
+    const QSize size = QImageReader(path).size();
+
+    if (size.isValid()) {
+        QMutexLocker locker(&m_mutex);
+        m_imageSizes.insert(path, size);
+    }
+
+    return size;
+}
+
+FillJobResult runFillJob(const FillJob &job, imageCache &cache,
+                         QThreadPool *computeThreadPool, qint32 maximumConcurrentTiles)
+{
+    FillJobResult result;
+    QElapsedTimer timer;
+    timer.start();
+
+    const QImage referenceImage = cache.image(job.imagePath, &result.cacheHit);
+
+    if (referenceImage.isNull()) {
+        result.error = QStringLiteral("cannot read image ") + job.imagePath;
+        return result;
+    }
+
+    const FillFunction fillFunction = fillFunctions.value(job.algorithm);
+    QImage fillMaskImage;
+
+    // The selections of all the seeds are merged keeping the maximum
+    for (const FillSeed &seed : job.seeds) {
+        const QImage seedFillMaskImage = fillFunction(referenceImage, seed.point, seed.threshold,
+                                                      computeThreadPool, maximumConcurrentTiles);
+
+        if (fillMaskImage.isNull()) {
+            fillMaskImage = seedFillMaskImage;
+            continue;
+        }
+
+        for (qint32 y = 0; y < fillMaskImage.height(); ++y) {
+            const quint8 *seedFillMaskPixel = seedFillMaskImage.scanLine(y);
+            quint8 *fillMaskPixel = fillMaskImage.scanLine(y);
+            for (qint32 x = 0; x < fillMaskImage.width(); ++x, ++seedFillMaskPixel, ++fillMaskPixel) {
+                *fillMaskPixel = qMax(*fillMaskPixel, *seedFillMaskPixel);
+            }
+        }
+    }
+
+    if (!job.outputPath.isEmpty()) {
+        QImageWriter writer(job.outputPath, job.outputFormat);
+        if (!writer.write(fillMaskImage)) {
+            result.error = writer.errorString();
+            result.processingTime = timer.nsecsElapsed();
+            return result;
+        }
+    }
+
+    result.ok = true;
+    result.processingTime = timer.nsecsElapsed();
+
+    return result;
+}
+
+jobScheduler::jobScheduler(qint32 maximumWorkers, qint32 maximumComputeThreads, imageCache &cache)
+    : m_cache(cache)
+    , m_maximumWorkers(qMax(2, maximumWorkers))
+    , m_maximumLargeJobs(m_maximumWorkers / 2)
+{
+    // Large jobs can take at most half of the workers, so at least one is
+    // always left for the small ones
+    if (maximumWorkers < 2) {
+        qWarning() << "At least 2 workers are needed to keep one for small jobs, using 2";
+    }
+
+    if (maximumComputeThreads < m_maximumWorkers) {
+        qWarning() << "Fewer threads than workers, some jobs will wait for compute threads";
+    }
+
+    m_jobThreadPool.setMaxThreadCount(m_maximumWorkers);
+    m_computeThreadPool.setMaxThreadCount(qMax(1, maximumComputeThreads));
+}
+
+jobScheduler::~jobScheduler()
+{
+    waitForDone();
+}
+
+void jobScheduler::submit(const FillJob &job, const JobFinishedCallback &callback)
+{
+    // The size of the image gives the cost of the job. It comes from the
+    // cache, so the file is only touched the first time an image is seen
+    const QSize imageSize = m_cache.imageSize(job.imagePath);
+    QueuedJob queuedJob {
+        job,
+        callback,
+        imageSize.isValid() && static_cast<qint64>(imageSize.width()) * imageSize.height() >= largeJobPixels,
+        QElapsedTimer()
+    };
+    queuedJob.timer.start();
+
+    QMutexLocker locker(&m_mutex);
+
+    if (!m_queues.contains(job.client)) {
+        m_clientOrder.append(job.client);
+    }
+    m_queues[job.client].append(queuedJob);
+    ++m_queuedJobs;
+
+    dispatch();
+}
+
+void jobScheduler::waitForDone()
+{
+    QMutexLocker locker(&m_mutex);
+
+    while (m_queuedJobs > 0 || m_runningJobs > 0) {
+        m_doneCondition.wait(&m_mutex);
+    }
+}
+
+qint32 jobScheduler::queueDepth()
+{
+    QMutexLocker locker(&m_mutex);
+
+    return m_queuedJobs;
+}
+
+void jobScheduler::dispatch()
+{
+    // Must be called with the mutex locked. When the next job of a client is
+    // large and can't get a worker, the first small job behind it is started
+    // instead, so jobs of the same size class still start in order. The
+    // client that gets a worker is moved to the back of the order
+    while (m_runningJobs < m_maximumWorkers) {
+        bool dispatched = false;
+
+        for (qint32 i = 0; i < m_clientOrder.size(); ++i) {
+            const QString client = m_clientOrder.at(i);
+            QList<QueuedJob> &queue = m_queues[client];
+            qint32 next = 0;
+
+            if (queue.first().large && m_runningLargeJobs >= m_maximumLargeJobs) {
+                while (next < queue.size() && queue.at(next).large) {
+                    ++next;
+                }
+                if (next == queue.size()) {
+                    continue;
+                }
+            }
+
+            QueuedJob queuedJob = queue.takeAt(next);
+
+            m_clientOrder.removeAt(i);
+            if (queue.isEmpty()) {
+                m_queues.remove(client);
+            } else {
+                m_clientOrder.append(client);
+            }
+
+            --m_queuedJobs;
+            ++m_runningJobs;
+            if (queuedJob.large) {
+                ++m_runningLargeJobs;
+            }
+
+            // The job gets an even share of the compute pool among the jobs
+            // running when it starts, and a large job never more than half
+            // of it, so there are always threads left for the small ones
+            const qint32 computeThreads = m_computeThreadPool.maxThreadCount();
+            qint32 maximumConcurrentTiles = qMax(1, computeThreads / m_runningJobs);
+            if (queuedJob.large) {
+                maximumConcurrentTiles = qMin(maximumConcurrentTiles, qMax(1, computeThreads / 2));
+            }
+
+            const qint32 queueDepth = m_queuedJobs;
+            QtConcurrent::run(&m_jobThreadPool, [this, queuedJob, queueDepth, maximumConcurrentTiles]()
+                                                {
+                                                    run(queuedJob, queueDepth, maximumConcurrentTiles);
+                                                });
+
+            dispatched = true;
+            break;
+        }
+
+        if (!dispatched) {
+            break;
+        }
+    }
+}
+
+void jobScheduler::run(QueuedJob queuedJob, qint32 queueDepth, qint32 maximumConcurrentTiles)
+{
+    const qint64 queueTime = queuedJob.timer.nsecsElapsed();
+
+    FillJobResult result = runFillJob(queuedJob.job, m_cache, &m_computeThreadPool, maximumConcurrentTiles);
+    result.queueTime = queueTime;
+    result.latency = queuedJob.timer.nsecsElapsed();
+    result.queueDepth = queueDepth;
+
+    qInfo() << "job" << queuedJob.job.id
+            << "latency" << (result.latency / 1000000.0) << "ms"
+            << "queue" << (result.queueTime / 1000000.0) << "ms"
+            << "queue depth" << queueDepth;
+
+    queuedJob.callback(queuedJob.job, result);
+
+    QMutexLocker locker(&m_mutex);
+
+    --m_runningJobs;
+    if (queuedJob.large) {
+        --m_runningLargeJobs;
+    }
+
+    dispatch();
+
+    if (m_queuedJobs == 0 && m_runningJobs == 0) {
+        m_doneCondition.wakeAll();
+    }
+}
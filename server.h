@@ -0,0 +1,133 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <QImage>
+#include <QPoint>
+#include <QString>
+#include <QByteArray>
+#include <QVector>
+#include <QList>
+#include <QHash>
+#include <QCache>
+#include <QSharedPointer>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThreadPool>
+#include <QElapsedTimer>
+
+#include <functional>
+
+struct FillSeed
+{
+    QPoint point;
+    quint8 threshold;
+};
+
+struct FillJob
+{
+    QString id;
+    // Jobs from the same client are started in order of arrival within each
+    // size class (a small job can start before a large one that is waiting
+    // for a worker), jobs from different clients are interleaved
+    QString client;
+    QString imagePath;
+    QVector<FillSeed> seeds;
+    QString algorithm;
+    QString outputPath;
+    QByteArray outputFormat;
+};
+
+struct FillJobResult
+{
+    bool ok {false};
+    QString error;
+    bool cacheHit {false};
+    qint64 queueTime {0};
+    qint64 processingTime {0};
+    qint64 latency {0};
+    qint32 queueDepth {0};
+};
+
+// Jobs are read one per line, as JSON objects like:
+// {"id": "1", "image": "test02.png", "seeds": [{"x": 10, "y": 20, "threshold": 64}],
+//  "threshold": 128, "algorithm": "floodFillScanLineMT", "output": "mask.png", "format": "png"}
+// "threshold" is the default for seeds that don't set their own one.
+// "algorithm" and "format" are optional
+bool parseFillJob(const QByteArray &line, FillJob &job, QString &error);
+QByteArray fillJobResultToJson(const FillJob &job, const FillJobResult &result);
+
+// LRU cache of decoded images, already converted to Format_Grayscale8
+class imageCache
+{
+public:
+    explicit imageCache(qint32 maximumSizeInMegabytes);
+
+    // Jobs asking for an image that is being decoded wait for that decode
+    // instead of starting another one
+    QImage image(const QString &path, bool *cacheHit);
+    // The sizes of the images are remembered even after they are evicted, so
+    // only the first call for an image reads its header from the file
+    QSize imageSize(const QString &path);
+
+private:
+    struct PendingDecode
+    {
+        bool done {false};
+        QImage image;
+    };
+
+    QMutex m_mutex;
+    QWaitCondition m_decodeCondition;
+    QCache<QString, QImage> m_cache;
+    QHash<QString, QSize> m_imageSizes;
+    QHash<QString, QSharedPointer<PendingDecode>> m_pendingDecodes;
+};
+
+// Runs at most maximumWorkers jobs at the same time. Clients are served round
+// robin and large jobs can only take some of the workers. All the fill work
+// runs on one bounded compute pool owned by the scheduler. Each job can
+// only keep its share of the threads busy, computed from the jobs running
+// when it starts, so a huge fill doesn't starve the small ones. The job
+// threads only coordinate the fills, decode the images and write the results
+class jobScheduler
+{
+public:
+    using JobFinishedCallback = std::function<void(const FillJob &job, const FillJobResult &result)>;
+
+    jobScheduler(qint32 maximumWorkers, qint32 maximumComputeThreads, imageCache &cache);
+    ~jobScheduler();
+
+    void submit(const FillJob &job, const JobFinishedCallback &callback);
+    void waitForDone();
+    qint32 queueDepth();
+
+private:
+    struct QueuedJob
+    {
+        FillJob job;
+        JobFinishedCallback callback;
+        bool large;
+        QElapsedTimer timer;
+    };
+
+    // Jobs on images of this many pixels or more are large
+    static constexpr qint64 largeJobPixels {4096 * 4096};
+
+    imageCache &m_cache;
+    QThreadPool m_jobThreadPool;
+    QThreadPool m_computeThreadPool;
+    QMutex m_mutex;
+    QWaitCondition m_doneCondition;
+    QHash<QString, QList<QueuedJob>> m_queues;
+    QList<QString> m_clientOrder;
+    qint32 m_maximumWorkers;
+    qint32 m_maximumLargeJobs;
+    qint32 m_queuedJobs {0};
+    qint32 m_runningJobs {0};
+    qint32 m_runningLargeJobs {0};
+
+    void dispatch();
+    void run(QueuedJob queuedJob, qint32 queueDepth, qint32 maximumConcurrentTiles);
+};
+
+#endif
@@ -0,0 +1,139 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QPointer>
+#include <QThread>
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QDebug>
+
+#include "server.h"
+
+// Jobs are read from stdin, one per line, and the results are written to
+// stdout. With --socket the jobs are read from a local socket instead and
+// the results are sent back to the client that submitted them
+
+int main(int argc, char ** argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Headless batch floodfill server");
+    parser.addHelpOption();
+    parser.addOptions({
+        {"socket", "Listen on the local socket <name> instead of reading stdin.", "name"},
+        {"workers", "Number of jobs run at the same time, at least 2.", "count",
+         QString::number(qMax(2, QThread::idealThreadCount() / 2))},
+        {"threads", "Number of threads shared by the jobs to run the fills, at least the number of workers.", "count",
+         QString::number(QThread::idealThreadCount())},
+        {"cache", "Size of the decoded image cache in megabytes.", "megabytes", "512"}
+    });
+    parser.process(app);
+
+    imageCache cache(parser.value("cache").toInt());
+    jobScheduler scheduler(parser.value("workers").toInt(), parser.value("threads").toInt(), cache);
+
+    if (!parser.isSet("socket")) {
+        QFile input;
+        QFile output;
+        QMutex outputMutex;
+
+        input.open(stdin, QIODevice::ReadOnly);
+        output.open(stdout, QIODevice::WriteOnly);
+
+        const auto writeResult = [&output, &outputMutex](const FillJob &job, const FillJobResult &result)
+                                 {
+                                     QMutexLocker locker(&outputMutex);
+                                     output.write(fillJobResultToJson(job, result));
+                                     output.flush();
+                                 };
+
+        while (true) {
+            // readLine blocks until a full line is available and only
+            // returns nothing at the end of the input
+            const QByteArray rawLine = input.readLine();
+            if (rawLine.isEmpty()) {
+                break;
+            }
+
+            const QByteArray line = rawLine.trimmed();
+            if (line.isEmpty()) {
+                continue;
+            }
+
+            FillJob job;
+            QString error;
+            if (!parseFillJob(line, job, error)) {
+                FillJobResult result;
+                result.error = error;
+                writeResult(job, result);
+                continue;
+            }
+
+            scheduler.submit(job, writeResult);
+        }
+
+        scheduler.waitForDone();
+
+        return 0;
+    }
+
+    QLocalServer server;
+    quint64 nextClientId = 0;
+
+    QLocalServer::removeServer(parser.value("socket"));
+    if (!server.listen(parser.value("socket"))) {
+        qCritical() << "Could not listen on" << parser.value("socket") << server.errorString();
+        return 1;
+    }
+
+    QObject::connect(&server, &QLocalServer::newConnection, [&]()
+    {
+        while (QLocalSocket *socket = server.nextPendingConnection()) {
+            const QString client = QString::number(nextClientId++);
+            const QPointer<QLocalSocket> socketPointer(socket);
+
+            QObject::connect(socket, &QLocalSocket::disconnected, socket, &QObject::deleteLater);
+            QObject::connect(socket, &QLocalSocket::readyRead, socket, [&, socket, socketPointer, client]()
+            {
+                // Results are produced on the workers, but the socket must
+                // only be used from the thread it lives in
+                const auto writeResult = [&server, socketPointer](const FillJob &job, const FillJobResult &result)
+                                         {
+                                             const QByteArray json = fillJobResultToJson(job, result);
+                                             QMetaObject::invokeMethod(&server, [socketPointer, json]()
+                                             {
+                                                 if (socketPointer) {
+                                                     socketPointer->write(json);
+                                                 }
+                                             }, Qt::QueuedConnection);
+                                         };
+
+                while (socket->canReadLine()) {
+                    const QByteArray line = socket->readLine().trimmed();
+                    if (line.isEmpty()) {
+                        continue;
+                    }
+
+                    FillJob job;
+                    QString error;
+                    if (!parseFillJob(line, job, error)) {
+                        FillJobResult result;
+                        result.error = error;
+                        socket->write(fillJobResultToJson(job, result));
+                        continue;
+                    }
+
+                    job.client = client;
+                    scheduler.submit(job, writeResult);
+                }
+
+                qInfo() << "queue depth" << scheduler.queueDepth();
+            });
+        }
+    });
+
+    return app.exec();
+}
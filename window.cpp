@@ -6,6 +6,8 @@
 #include <QElapsedTimer>
 
 #include "floodfill.h"
+#include "postprocess.h"
+#include "selectioncontour.h"
 
 // for TEST_IMAGE choose:
 // * ":/test01.png" (small size image)
@@ -17,8 +19,14 @@
 // * floodFillScanLine (scanline floodfill)
 // * floodFillMT (multithreaded naive floodfill)
 // * floodFillScanLineMT (multithreaded scanline floodfill)
+// * selectSimilarMT (multithreaded non contiguous selection)
 #define FLOODFILL_ALGORITHM floodFillScanLineMT
 
+// POSTPROCESS_PIPELINE is a list of operations applied to the selection after
+// the fill, for example:
+// {{PostProcessOperation::Grow, 4}, {PostProcessOperation::FillHoles, 0}, {PostProcessOperation::Feather, 8}}
+#define POSTPROCESS_PIPELINE {}
+
 window::window()
 {
     loadReferenceImage();
@@ -37,14 +45,31 @@ void window::paintEvent(QPaintEvent*)
 
     p.drawImage(0, 0, m_referenceImage);
 
-    QImage ff(m_floodFillImage.size(), QImage::Format_ARGB32);
-    ff.fill(qRgb(192, 192, 192));
-    ff.setAlphaChannel(m_floodFillImage);
-    p.drawImage(0, 0, ff);
+    if (vizMode == 0) {
+        QImage ff(m_floodFillImage.size(), QImage::Format_ARGB32);
+        ff.fill(qRgb(192, 192, 192));
+        ff.setAlphaChannel(m_floodFillImage);
+        p.drawImage(0, 0, ff);
+    } else {
+        // The outline is only extracted when it has to be drawn
+        if (!m_selectionOutlineValid) {
+            updateSelectionOutline();
+        }
+        p.setPen(QPen(Qt::white, 0));
+        p.drawPath(m_selectionOutline);
+        p.setPen(QPen(Qt::black, 0, Qt::DashLine));
+        p.drawPath(m_selectionOutline);
+    }
 }
 
 void window::mousePressEvent(QMouseEvent *e)
 {
+    if (e->button() == Qt::RightButton) {
+        vizMode = 1 - vizMode;
+        update();
+        return;
+    }
+
     if (!m_referenceImage.rect().contains(e->pos())) {
         return;
     }
@@ -61,5 +86,22 @@ void window::loadReferenceImage()
 
 void window::createFloodFillSelection(const QPoint &p)
 {
-    m_floodFillImage = FLOODFILL_ALGORITHM(m_referenceImage, p, 128);
+    m_floodFillImage = postProcessMT(FLOODFILL_ALGORITHM(m_referenceImage, p, 128), POSTPROCESS_PIPELINE);
+    m_selectionOutline = QPainterPath();
+    m_selectionOutlineValid = false;
+}
+
+void window::updateSelectionOutline()
+{
+    m_selectionOutline = QPainterPath();
+    m_selectionOutlineValid = true;
+
+    if (m_floodFillImage.isNull()) {
+        return;
+    }
+
+    for (const QPolygonF &contour : extractSelectionContoursMT(m_floodFillImage, 1, 0.5)) {
+        m_selectionOutline.addPolygon(contour);
+        m_selectionOutline.closeSubpath();
+    }
 }
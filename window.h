@@ -2,6 +2,7 @@
 #define WINDOW_H
 
 #include <QWidget>
+#include <QPainterPath>
 
 class window : public QWidget
 {
@@ -17,11 +18,16 @@ public:
 private:
     QImage m_referenceImage;
     QImage m_floodFillImage;
+    QPainterPath m_selectionOutline;
+    bool m_selectionOutlineValid {false};
 
+    // 0: composite the selection image, 1: draw the selection outline.
+    // Right click switches between them
     int vizMode {0};
 
     void loadReferenceImage();
     void createFloodFillSelection(const QPoint &p);
+    void updateSelectionOutline();
 };
 
 #endif
\ No newline at end of file